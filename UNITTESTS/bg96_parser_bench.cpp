@@ -0,0 +1,132 @@
+// Cost of each AT response parser per response: CPU cycles spent in the
+// parser and heap allocations it makes. UART time is virtual and excluded.
+//
+//   bg96_parser_bench [iterations]
+
+#include <chrono>
+#include <string>
+#include "bg96_parser.h"
+#include "ReplayFileHandle.h"
+#include "alloc_counter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLE_UNIT      "cycles"
+static inline uint64_t cycles_now(void)
+{
+    return __rdtsc();
+}
+#else
+#define CYCLE_UNIT      "ns"
+static inline uint64_t cycles_now(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+static char _buf[256];
+static char _parsebuf[POOL_PARSE_BUF_SIZE];
+static gps_data _gps;
+
+static bool run_apn(ATCmdParser &parser)
+{
+    return checknSetApn_BG96(parser, "lte-internet.sktelecom.com") == RET_OK;
+}
+
+static bool run_dns(ATCmdParser &parser)
+{
+    return getIpAddressByName_BG96(parser, "example.com", _buf, 46) == RET_OK;
+}
+
+static bool run_qiact(ATCmdParser &parser)
+{
+    return getIpAddress_BG96(parser, _buf, 46) == RET_OK;
+}
+
+static bool run_qird(ATCmdParser &parser)
+{
+    int len;
+    return recvData_BG96(parser, _buf, sizeof(_buf), &len) == RET_OK;
+}
+
+static bool run_gps(ATCmdParser &parser)
+{
+    return getGpsLocation_BG96(parser, &_gps) == RET_OK;
+}
+
+struct Scenario {
+    const char *capture;
+    bool (*run)(ATCmdParser &parser);
+};
+
+static const Scenario scenarios[] = {
+    { "apn_match.cap",      run_apn },
+    { "apn_urc.cap",        run_apn },
+    { "dns_single.cap",     run_dns },
+    { "dns_urc.cap",        run_dns },
+    { "qiact_ipv4.cap",     run_qiact },
+    { "qiact_urc.cap",      run_qiact },
+    { "qird_basic.cap",     run_qird },
+    { "qird_urc.cap",       run_qird },
+    { "gps_fix.cap",        run_gps },
+    { "gps_urc.cap",        run_gps },
+};
+
+static const size_t chunks[] = { 4096, 1 };
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    bool ok = true;
+
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    printf("%-16s %6s %14s %14s\n", "capture", "chunk", CYCLE_UNIT "/resp", "allocs/resp");
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        Capture capture;
+        std::string path = std::string(CAPTURE_DIR "/") + scenarios[s].capture;
+
+        if (!load_capture(path.c_str(), capture)) {
+            printf("cannot load %s\n", path.c_str());
+            return 1;
+        }
+
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            ReplayTiming timing = { chunks[c], 115200, 0, 200 };
+            uint64_t cycles = 0;
+            size_t allocs = 0;
+
+            for (int i = 0; i < iterations; i++) {
+                host_clock_reset();
+                ReplayFileHandle fh(capture, timing);
+                ATCmdParser parser(&fh, "\r\n", 256, BG96_DEFAULT_TIMEOUT);
+                setUrcHandlers_BG96(parser);
+                setParseBuffer_BG96(_parsebuf);
+
+                size_t a0 = alloc_count();
+                uint64_t t0 = cycles_now();
+                bool done = scenarios[s].run(parser);
+                cycles += cycles_now() - t0;
+                allocs += alloc_count() - a0;
+
+                takeRecvUrc_BG96();
+                if (!done) {
+                    printf("%s: parse failed\n", scenarios[s].capture);
+                    ok = false;
+                    break;
+                }
+            }
+
+            printf("%-16s %6u %14llu %14.2f\n", scenarios[s].capture, (unsigned)chunks[c],
+                   (unsigned long long)(cycles / iterations), (double)allocs / iterations);
+            if (allocs != 0) {
+                ok = false;
+            }
+        }
+    }
+
+    return ok ? 0 : 1;
+}
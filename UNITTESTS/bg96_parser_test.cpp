@@ -0,0 +1,385 @@
+// Replays hand-written BG96 UART captures through the AT response parsers and
+// the ATCmdParser from MBED_OS_DIR, at several chunk sizes and line speeds.
+
+#include <string>
+#include "bg96_parser.h"
+#include "ReplayFileHandle.h"
+#include "alloc_counter.h"
+
+#define CANARY                      0x5A
+#define CANARY_SIZE                 8
+
+static int _failures = 0;
+static const char *_case = "";
+static const ReplayTiming *_timing = NULL;
+static char _parsebuf[POOL_PARSE_BUF_SIZE];
+
+#define EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            _failures++; \
+            printf("FAIL %s [chunk %u, %u baud, gap %u us]: %s:%d: %s\n", _case, \
+                   (unsigned)_timing->chunk, (unsigned)_timing->baud, (unsigned)_timing->gap_us, \
+                   __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+// Split reads: one byte at a time up to everything at once, on a fast and
+// a slow link, and with pauses far longer than a byte time between chunks.
+static const ReplayTiming timings[] = {
+    { 4096, 115200,      0,  200 },
+    {   64, 115200,      0,  200 },
+    {   16, 115200,      0,  200 },
+    {    7, 115200,      0,  200 },
+    {    3, 115200,      0,  200 },
+    {    1, 115200,      0,  200 },
+    {    1,   9600,      0, 5000 },
+    {    5, 115200,  20000,  200 },
+    {   11, 115200, 300000,  200 },
+};
+
+// One parser run over a capture, with a canary behind the caller's buffer
+struct Replay {
+    Capture capture;
+    ReplayFileHandle *fh;
+    ATCmdParser *parser;
+    char buf[256 + CANARY_SIZE];
+    size_t allocs;
+
+    Replay(const char *name) : fh(NULL), parser(NULL), allocs(0)
+    {
+        std::string path = std::string(CAPTURE_DIR "/") + name;
+
+        _case = name;
+        if (!load_capture(path.c_str(), capture)) {
+            printf("FAIL %s: cannot load %s\n", name, path.c_str());
+            exit(1);
+        }
+        host_clock_reset();
+        fh = new ReplayFileHandle(capture, *_timing);
+        parser = new ATCmdParser(fh, "\r\n", 256, BG96_DEFAULT_TIMEOUT);
+        setUrcHandlers_BG96(*parser);
+        setParseBuffer_BG96(_parsebuf);
+        takeRecvUrc_BG96();
+        memset(buf, CANARY, sizeof(buf));
+    }
+
+    ~Replay()
+    {
+        delete parser;
+        delete fh;
+    }
+
+    // Arms the allocation counter; done() returns what the parser allocated
+    void begin() { allocs = alloc_count(); }
+    size_t done() { return alloc_count() - allocs; }
+
+    bool canary(size_t size) const
+    {
+        for (size_t i = size; i < size + CANARY_SIZE; i++) {
+            if ((unsigned char)buf[i] != CANARY) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// ----------------------------------------------------------------
+// APN
+// ----------------------------------------------------------------
+
+static void test_apn(void)
+{
+    {
+        Replay r("apn_match.cap");
+        r.begin();
+        EXPECT(checknSetApn_BG96(*r.parser, "lte-internet.sktelecom.com") == RET_OK);
+        EXPECT(r.done() == 0);
+        EXPECT(r.fh->finished());
+        EXPECT(!takeRecvUrc_BG96());
+    }
+    {
+        Replay r("apn_mismatch.cap");
+        EXPECT(checknSetApn_BG96(*r.parser, "lte-internet.sktelecom.com") == RET_OK);
+        EXPECT(r.fh->finished());
+    }
+    {
+        Replay r("apn_urc.cap");
+        EXPECT(checknSetApn_BG96(*r.parser, "lte-internet.sktelecom.com") == RET_OK);
+        EXPECT(r.fh->finished());
+        EXPECT(takeRecvUrc_BG96());
+    }
+    {
+        Replay r("apn_oversize.cap");
+        r.begin();
+        EXPECT(checknSetApn_BG96(*r.parser, "lte-internet.sktelecom.com") == RET_NOK);
+        EXPECT(r.done() == 0);
+    }
+    {
+        Replay r("apn_no_ok.cap");
+        EXPECT(checknSetApn_BG96(*r.parser, "lte-internet.sktelecom.com") == RET_NOK);
+        EXPECT(r.fh->error().empty());
+    }
+}
+
+// ----------------------------------------------------------------
+// DNS
+// ----------------------------------------------------------------
+
+static void test_dns(void)
+{
+    {
+        Replay r("dns_single.cap");
+        r.begin();
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 46) == RET_OK);
+        EXPECT(r.done() == 0);
+        EXPECT(strcmp(r.buf, "93.184.216.34") == 0);
+        EXPECT(r.canary(46));
+        EXPECT(r.fh->finished());
+    }
+    {
+        Replay r("dns_multi.cap");
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 46) == RET_OK);
+        EXPECT(strcmp(r.buf, "93.184.216.34") == 0);
+        EXPECT(r.fh->unread() == 2);   // only the CRLF after the last address
+    }
+    {
+        Replay r("dns_urc.cap");
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 46) == RET_OK);
+        EXPECT(strcmp(r.buf, "93.184.216.34") == 0);
+        EXPECT(takeRecvUrc_BG96());
+    }
+    {
+        // Exactly fits: 13 characters and the terminator
+        Replay r("dns_single.cap");
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 14) == RET_OK);
+        EXPECT(strcmp(r.buf, "93.184.216.34") == 0);
+        EXPECT(r.canary(14));
+    }
+    {
+        Replay r("dns_single.cap");
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 13) == RET_NOK);
+        EXPECT(r.buf[0] == '\0');
+        EXPECT(r.canary(13));
+    }
+    {
+        Replay r("dns_oversize.cap");
+        r.begin();
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 46) == RET_NOK);
+        EXPECT(r.done() == 0);
+        EXPECT(r.buf[0] == '\0');
+        EXPECT(r.canary(46));
+    }
+    {
+        Replay r("dns_error.cap");
+        EXPECT(getIpAddressByName_BG96(*r.parser, "example.com", r.buf, 46) == RET_NOK);
+        EXPECT(r.buf[0] == '\0');
+    }
+}
+
+// ----------------------------------------------------------------
+// PDP context
+// ----------------------------------------------------------------
+
+static void test_qiact(void)
+{
+    {
+        Replay r("qiact_ipv4.cap");
+        r.begin();
+        EXPECT(getIpAddress_BG96(*r.parser, r.buf, 46) == RET_OK);
+        EXPECT(r.done() == 0);
+        EXPECT(strcmp(r.buf, "10.165.31.99") == 0);
+        EXPECT(r.canary(46));
+        EXPECT(r.fh->finished());
+    }
+    {
+        Replay r("qiact_ipv6.cap");
+        EXPECT(getIpAddress_BG96(*r.parser, r.buf, 46) == RET_OK);
+        EXPECT(strcmp(r.buf, "2001:2d8:e2a5:1a2b:0:47:b3c5:7101") == 0);
+        EXPECT(r.canary(46));
+    }
+    {
+        // An IPv6 address into a buffer sized for IPv4
+        Replay r("qiact_ipv6.cap");
+        r.begin();
+        EXPECT(getIpAddress_BG96(*r.parser, r.buf, 16) == RET_NOK);
+        EXPECT(r.done() == 0);
+        EXPECT(r.buf[0] == '\0');
+        EXPECT(r.canary(16));
+    }
+    {
+        Replay r("qiact_urc.cap");
+        EXPECT(getIpAddress_BG96(*r.parser, r.buf, 46) == RET_OK);
+        EXPECT(strcmp(r.buf, "10.165.31.99") == 0);
+        EXPECT(takeRecvUrc_BG96());
+    }
+}
+
+// ----------------------------------------------------------------
+// Socket receive
+// ----------------------------------------------------------------
+
+static void test_qird(void)
+{
+    int len;
+
+    {
+        Replay r("qird_basic.cap");
+        r.begin();
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_OK);
+        EXPECT(r.done() == 0);
+        EXPECT(len == 7);
+        EXPECT(strcmp(r.buf, "S:OK:A1") == 0);
+        EXPECT(r.canary(256));
+        EXPECT(r.fh->finished());
+    }
+    {
+        Replay r("qird_urc.cap");
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_OK);
+        EXPECT(len == 4);
+        EXPECT(strcmp(r.buf, "S:OK") == 0);
+        EXPECT(!takeRecvUrc_BG96());    // the read took the data the URC announced
+    }
+    {
+        Replay r("qird_binary.cap");
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_OK);
+        EXPECT(len == 13);
+        EXPECT(strcmp(r.buf, "OK\r\nC:ERROR\r\n") == 0);
+    }
+    {
+        Replay r("qird_oversize.cap");
+        r.begin();
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_NOK);
+        EXPECT(r.done() == 0);
+        EXPECT(len == 0);
+        EXPECT(r.buf[0] == '\0');
+        EXPECT(r.canary(256));
+    }
+    {
+        Replay r("qird_empty.cap");
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_NOK);
+        EXPECT(len == 0);
+        EXPECT(r.buf[0] == '\0');
+    }
+    {
+        Replay r("qird_truncated.cap");
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_NOK);
+        EXPECT(len == 0);
+        EXPECT(r.buf[0] == '\0');
+        EXPECT(r.canary(256));
+    }
+}
+
+// A rejected D: report and the registration after it, as the main loop runs
+// them. The URC of the first reply must not count for the second one.
+static void test_session_exchange(void)
+{
+    char frame[] = "D:node01:0.50:A1B2";
+    char regframe[] = "R+G:node01:37.56667,126.98333";
+    int len;
+
+    Replay r("session_rejected.cap");
+
+    EXPECT(sockOpenConnect_BG96(*r.parser, "TCP", "13.125.176.228", 80) == RET_OK);
+    sendData_BG96(*r.parser, frame, strlen(frame));
+    host_clock_advance_to(host_clock_us() + 500 * 1000);    // wait_ms(500) in main()
+    EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_OK);
+    EXPECT(strcmp(r.buf, "S:ERROR") == 0);
+    EXPECT(sockClose_BG96(*r.parser) == RET_OK);
+
+    EXPECT(sockOpenConnect_BG96(*r.parser, "TCP", "13.125.176.228", 80) == RET_OK);
+    sendData_BG96(*r.parser, regframe, strlen(regframe));
+    EXPECT(waitRecvData_BG96(*r.parser, 5000) == RET_OK);
+    EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_OK);
+    EXPECT(strcmp(r.buf, "S:OK:C3D4") == 0);
+    EXPECT(sockClose_BG96(*r.parser) == RET_OK);
+
+    EXPECT(r.fh->error() == "");
+    EXPECT(r.fh->finished());
+    EXPECT(!takeRecvUrc_BG96());
+}
+
+// ----------------------------------------------------------------
+// GPS
+// ----------------------------------------------------------------
+
+static void test_gps(void)
+{
+    gps_data gps;
+
+    {
+        Replay r("gps_fix.cap");
+        r.begin();
+        EXPECT(getGpsLocation_BG96(*r.parser, &gps) == RET_OK);
+        EXPECT(r.done() == 0);
+        EXPECT(gps.lat > 37.56666f && gps.lat < 37.56668f);
+        EXPECT(gps.lon > 126.98332f && gps.lon < 126.98334f);
+        EXPECT(gps.fix == 3);
+        EXPECT(gps.nsat == 7);
+        EXPECT(strcmp(gps.date, "190417") == 0);
+        EXPECT(r.fh->finished());
+    }
+    {
+        Replay r("gps_retry.cap");
+        EXPECT(getGpsLocation_BG96(*r.parser, &gps) == RET_OK);
+        EXPECT(gps.lat < -33.86784f && gps.lat > -33.86786f);
+        EXPECT(gps.fix == 2);
+        EXPECT(gps.nsat == 11);
+        EXPECT(r.fh->finished());
+    }
+    {
+        Replay r("gps_urc.cap");
+        EXPECT(getGpsLocation_BG96(*r.parser, &gps) == RET_OK);
+        EXPECT(gps.nsat == 7);
+        EXPECT(takeRecvUrc_BG96());
+    }
+    {
+        Replay r("gps_nofix.cap");
+        EXPECT(getGpsLocation_BG96(*r.parser, &gps) == RET_NOK);
+        EXPECT(gps.lat == 0.0f && gps.lon == 0.0f);
+        EXPECT(host_clock_us() >= BG96_CONNECT_TIMEOUT * 1000ULL);
+    }
+    {
+        Replay r("gps_oversize.cap");
+        EXPECT(getGpsLocation_BG96(*r.parser, &gps) == RET_NOK);
+        EXPECT(r.fh->error().empty());
+    }
+}
+
+// A modem that stalls for longer than BG96_RECV_TIMEOUT mid-payload
+static void test_stall(void)
+{
+    static const ReplayTiming stall = { 4, 115200, 800000, 200 };
+    int len;
+
+    _timing = &stall;
+    {
+        Replay r("qird_basic.cap");
+        EXPECT(recvData_BG96(*r.parser, r.buf, 256, &len) == RET_NOK);
+        EXPECT(len == 0);
+        EXPECT(r.buf[0] == '\0');
+        EXPECT(r.canary(256));
+    }
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < sizeof(timings) / sizeof(timings[0]); i++) {
+        _timing = &timings[i];
+        test_apn();
+        test_dns();
+        test_qiact();
+        test_qird();
+        test_session_exchange();
+        test_gps();
+    }
+    test_stall();
+
+    if (_failures) {
+        printf("%d check(s) failed\n", _failures);
+        return 1;
+    }
+    printf("all checks passed over %u timings\n", (unsigned)(sizeof(timings) / sizeof(timings[0])));
+    return 0;
+}
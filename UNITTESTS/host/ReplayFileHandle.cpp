@@ -0,0 +1,216 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <poll.h>
+#include "ReplayFileHandle.h"
+
+// Headroom for exchanges that repeat, e.g. a GPS retry loop
+#define REPLAY_REPEAT_RESERVE       64
+
+static std::string unescape(const std::string &raw)
+{
+    std::string out;
+
+    for (size_t i = 0; i < raw.size(); i++) {
+        if (raw[i] == '\\' && i + 1 < raw.size()) {
+            char c = raw[++i];
+            out += (c == 'r') ? '\r' : (c == 'n') ? '\n' : c;
+        } else {
+            out += raw[i];
+        }
+    }
+    return out;
+}
+
+bool load_capture(const char *path, Capture &capture)
+{
+    std::ifstream in(path);
+    std::string line;
+
+    if (!in) {
+        return false;
+    }
+
+    capture.exchanges.clear();
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        if (line.compare(0, 2, "> ") == 0 || (line.size() > 2 && line[0] == '>' && line[2] == ' '
+                                                && strchr("*!~", line[1]) != NULL)) {
+            CaptureExchange exchange;
+            char kind = line[1];
+            exchange.repeat = kind == '*';
+            exchange.strict = kind == '!';
+            exchange.raw = kind == '~';
+            exchange.command = line.substr(kind == ' ' ? 2 : 3);
+            if (exchange.raw) {
+                exchange.command = unescape(exchange.command);
+            }
+            capture.exchanges.push_back(exchange);
+        } else if (line.compare(0, 2, "= ") == 0 && !capture.exchanges.empty()) {
+            CaptureExchange &exchange = capture.exchanges.back();
+            exchange.pauses.push_back(std::make_pair(exchange.response.size(),
+                                                     (uint32_t)atoi(line.c_str() + 2) * 1000));
+        } else if (line == "<" || line.compare(0, 3, "<~ ") == 0 || line.compare(0, 2, "< ") == 0) {
+            if (capture.exchanges.empty()) {
+                CaptureExchange exchange;
+                exchange.repeat = exchange.strict = exchange.raw = false;
+                capture.exchanges.push_back(exchange);
+            }
+            if (line.size() > 1 && line[1] == '~') {
+                capture.exchanges.back().response += unescape(line.substr(3));
+            } else {
+                capture.exchanges.back().response += (line.size() > 2 ? line.substr(2) : "") + "\r\n";
+            }
+        } else {
+            fprintf(stderr, "%s: bad capture line: %s\n", path, line.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+ReplayFileHandle::ReplayFileHandle(const Capture &capture, const ReplayTiming &timing)
+    : _capture(capture), _timing(timing), _next(0), _rx_pos(0), _reply_us(0)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < _capture.exchanges.size(); i++) {
+        const CaptureExchange &exchange = _capture.exchanges[i];
+        total += exchange.response.size() * (exchange.repeat ? REPLAY_REPEAT_RESERVE : 1);
+    }
+    _rx.reserve(total);
+    _rx_time.reserve(total);
+    _tx_line.reserve(256);
+
+    if (!_capture.exchanges.empty() && _capture.exchanges[0].command.empty()) {
+        schedule(_capture.exchanges[0]);
+        _next = 1;
+    }
+}
+
+ssize_t ReplayFileHandle::read(void *buffer, size_t size)
+{
+    char *out = static_cast<char *>(buffer);
+    uint64_t now = host_clock_us();
+    size_t n = 0;
+
+    while (n < size && _rx_pos < _rx.size() && _rx_time[_rx_pos] <= now) {
+        out[n++] = _rx[_rx_pos++];
+    }
+    return n > 0 ? (ssize_t)n : -EAGAIN;
+}
+
+ssize_t ReplayFileHandle::write(const void *buffer, size_t size)
+{
+    const char *in = static_cast<const char *>(buffer);
+
+    for (size_t i = 0; i < size; i++) {
+        if (_next < _capture.exchanges.size() && _capture.exchanges[_next].raw) {
+            // Socket data has no line end: match as soon as all of it was written
+            _tx_line += in[i];
+            if (_tx_line == _capture.exchanges[_next].command) {
+                command(_tx_line);
+                _tx_line.clear();
+            }
+        } else if (in[i] == '\n') {
+            if (!_tx_line.empty() && _tx_line[_tx_line.size() - 1] == '\r') {
+                _tx_line.erase(_tx_line.size() - 1);
+            }
+            command(_tx_line);
+            _tx_line.clear();
+        } else {
+            _tx_line += in[i];
+        }
+    }
+    return size;
+}
+
+off_t ReplayFileHandle::seek(off_t, int)
+{
+    return -ESPIPE;
+}
+
+int ReplayFileHandle::close()
+{
+    return 0;
+}
+
+short ReplayFileHandle::poll(short events) const
+{
+    short revents = POLLOUT;
+
+    if (_rx_pos < _rx.size() && _rx_time[_rx_pos] <= host_clock_us()) {
+        revents |= POLLIN;
+    }
+    return revents & events;
+}
+
+uint64_t ReplayFileHandle::next_arrival_us() const
+{
+    return _rx_pos < _rx.size() ? _rx_time[_rx_pos] : UINT64_MAX;
+}
+
+size_t ReplayFileHandle::unread() const
+{
+    return _rx.size() - _rx_pos;
+}
+
+bool ReplayFileHandle::finished() const
+{
+    return _error.empty()
+        && (_next == _capture.exchanges.size() || _capture.exchanges[_next].repeat);
+}
+
+const std::string &ReplayFileHandle::error() const
+{
+    return _error;
+}
+
+void ReplayFileHandle::command(const std::string &line)
+{
+    if (_next < _capture.exchanges.size() && _capture.exchanges[_next].command == line) {
+        if (_capture.exchanges[_next].strict && _reply_us > host_clock_us() && _error.empty()) {
+            _error = "sent before earlier modem output arrived: " + line;
+        }
+        schedule(_capture.exchanges[_next]);
+        if (!_capture.exchanges[_next].repeat) {
+            _next++;
+        }
+    } else if (_error.empty()) {
+        _error = "unexpected command: " + line;
+    }
+}
+
+void ReplayFileHandle::schedule(const CaptureExchange &exchange)
+{
+    const std::string &response = exchange.response;
+    size_t pause = 0;
+
+    // 10 bit times per byte: start, 8 data, stop
+    uint64_t byte_ns = 10000000000ULL / _timing.baud;
+    uint64_t start = host_clock_us() + _timing.latency_us;
+    size_t chunk = _timing.chunk ? _timing.chunk : 1;
+
+    if (!_rx_time.empty() && _rx_time.back() > start) {
+        start = _rx_time.back();
+    }
+
+    for (size_t i = 0; i < response.size(); i++) {
+        while (pause < exchange.pauses.size() && exchange.pauses[pause].first == i) {
+            start += exchange.pauses[pause++].second;
+            _reply_us = start;
+        }
+        size_t end = (i / chunk + 1) * chunk;
+        if (end > response.size()) {
+            end = response.size();
+        }
+        _rx += response[i];
+        _rx_time.push_back(start + end * byte_ns / 1000 + (i / chunk) * _timing.gap_us);
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef REPLAY_FILE_HANDLE_H
+#define REPLAY_FILE_HANDLE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "mbed.h"
+
+// One command written by the firmware and the modem output it releases
+struct CaptureExchange {
+    std::string command;    // empty: output the modem sends before any command
+    std::string response;
+    bool repeat;            // answers the same command again and again (">*")
+    bool raw;               // socket data written without a line end (">~")
+    bool strict;            // only valid once earlier modem output has arrived (">!")
+    std::vector<std::pair<size_t, uint32_t> > pauses;   // response offset, pause in us
+};
+
+// A UART session, written by hand from the BG96 AT command manual.
+// Capture files are line based:
+//   > AT+QIACT?        command the firmware is expected to send
+//   >* AT+QGPSLOC=2    same, but the exchange repeats for every further send
+//   >! AT+QIRD=0,255   same, but sending it before the output after the last
+//                      pause started is an error, e.g. reading before the recv URC
+//   >~ D:node:1.00     socket data, written without a line end (escaped as <~)
+//   < +QIACT: 1,1,1    modem line, CRLF appended
+//   <~ 12345\r\n       raw modem bytes, only \r, \n and \\ are escaped
+//   = 300              the rest of the modem output comes 300 ms later
+//   # comment
+struct Capture {
+    std::vector<CaptureExchange> exchanges;
+};
+
+bool load_capture(const char *path, Capture &capture);
+
+// How the capture reaches the parser: bytes come in chunks of 'chunk', each
+// chunk at UART speed and 'gap_us' after the previous one, the first one
+// 'latency_us' after the command was written.
+struct ReplayTiming {
+    size_t chunk;
+    uint32_t baud;
+    uint32_t gap_us;
+    uint32_t latency_us;
+};
+
+// Fake UART for ATCmdParser. All buffers are reserved up front, so the
+// allocation counter only sees what the parser code itself allocates.
+class ReplayFileHandle : public mbed::FileHandle {
+public:
+    ReplayFileHandle(const Capture &capture, const ReplayTiming &timing);
+
+    virtual ssize_t read(void *buffer, size_t size);
+    virtual ssize_t write(const void *buffer, size_t size);
+    virtual off_t seek(off_t offset, int whence = SEEK_SET);
+    virtual int close();
+    virtual short poll(short events) const;
+
+    uint64_t next_arrival_us() const;   // UINT64_MAX if nothing is in flight
+    size_t unread() const;              // modem bytes not taken by the parser yet
+    bool finished() const;              // every command was sent, in order
+    const std::string &error() const;   // first unexpected command, if any
+
+private:
+    void command(const std::string &line);
+    void schedule(const CaptureExchange &exchange);
+
+    const Capture &_capture;
+    ReplayTiming _timing;
+    size_t _next;
+    std::string _rx;
+    std::vector<uint64_t> _rx_time;
+    size_t _rx_pos;
+    uint64_t _reply_us;     // when the output after the last "=" pause starts
+    std::string _tx_line;
+    std::string _error;
+};
+
+#endif // REPLAY_FILE_HANDLE_H
@@ -0,0 +1,74 @@
+#include <cstdlib>
+#include <new>
+#include "alloc_counter.h"
+
+static size_t _alloc_count = 0;
+
+size_t alloc_count(void)
+{
+    return _alloc_count;
+}
+
+#if defined(__GLIBC__)
+// Interpose the C allocator too, so vsscanf/printf internals are counted
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    _alloc_count++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    _alloc_count++;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    _alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+#define RAW_MALLOC(size)    __libc_malloc(size)
+#else
+#define RAW_MALLOC(size)    std::malloc(size)
+#endif
+
+void *operator new(size_t size)
+{
+    _alloc_count++;
+    void *ptr = RAW_MALLOC(size ? size : 1);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
@@ -0,0 +1,10 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <stddef.h>
+
+// Heap allocations made by this process so far: operator new and, on glibc,
+// malloc/calloc/realloc. Linked into the test programs only.
+size_t alloc_count(void);
+
+#endif // ALLOC_COUNTER_H
@@ -0,0 +1,13 @@
+#ifndef HOST_CLOCK_H
+#define HOST_CLOCK_H
+
+#include <stdint.h>
+
+// Virtual time for the host build. Nothing sleeps: poll() jumps the clock to
+// the next byte arrival of the replayed capture, or to its own deadline.
+uint64_t host_clock_us(void);
+void host_clock_advance_to(uint64_t us);
+void host_clock_reset(void);
+void host_clock_tick(void);     // busy loops polling a Timer cost 1 us per read
+
+#endif // HOST_CLOCK_H
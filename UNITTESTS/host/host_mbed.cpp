@@ -0,0 +1,90 @@
+#include <cstdarg>
+#include "mbed.h"
+#include "ReplayFileHandle.h"
+
+static uint64_t _now_us = 0;
+
+uint64_t host_clock_us(void)
+{
+    return _now_us;
+}
+
+void host_clock_advance_to(uint64_t us)
+{
+    if (us > _now_us) {
+        _now_us = us;
+    }
+}
+
+void host_clock_reset(void)
+{
+    _now_us = 0;
+}
+
+void host_clock_tick(void)
+{
+    _now_us++;
+}
+
+namespace mbed {
+
+int Serial::printf(const char *format, ...)
+{
+    static const bool enabled = getenv("BG96_HOST_LOG") != NULL;
+    int ret = 0;
+
+    if (enabled) {
+        va_list args;
+        va_start(args, format);
+        ret = vprintf(format, args);
+        va_end(args);
+    }
+    return ret;
+}
+
+// Same as platform/FileHandle.cpp, without pulling in the retarget layer
+off_t FileHandle::size()
+{
+    off_t off = tell();
+    off_t size = seek(0, SEEK_END);
+    seek(off, SEEK_SET);
+    return size;
+}
+
+// Replaces platform/mbed_poll.cpp: instead of sleeping, advance the virtual clock
+int poll(pollfh fhs[], unsigned nfhs, int timeout)
+{
+    uint64_t deadline = timeout < 0 ? UINT64_MAX : host_clock_us() + (uint64_t)timeout * 1000;
+
+    while (true) {
+        int count = 0;
+        uint64_t next = deadline;
+
+        for (unsigned i = 0; i < nfhs; i++) {
+            fhs[i].revents = fhs[i].fh->poll(fhs[i].events) & fhs[i].events;
+            if (fhs[i].revents) {
+                count++;
+            }
+
+            ReplayFileHandle *replay = dynamic_cast<ReplayFileHandle *>(fhs[i].fh);
+            if (replay && replay->next_arrival_us() < next) {
+                next = replay->next_arrival_us();
+            }
+        }
+
+        if (count > 0 || timeout == 0 || host_clock_us() >= deadline || next == UINT64_MAX) {
+            return count;
+        }
+        host_clock_advance_to(next);
+    }
+}
+
+} // namespace mbed
+
+Serial pc;
+
+extern "C" void mbed_assert_internal(const char *expr, const char *file, int line)
+{
+    fprintf(stderr, "mbed assertation failed: %s, file: %s, line %d\n", expr, file, line);
+    abort();
+}
@@ -0,0 +1,40 @@
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+// Host stand-in for mbed.h: the ATCmdParser from MBED_OS_DIR, plus the few
+// target classes the parsers use, driven by the virtual clock in host_clock.h.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include "platform/ATCmdParser.h"
+#include "host_clock.h"
+
+namespace mbed {
+
+class Serial {
+public:
+    int printf(const char *format, ...);    // silent unless BG96_HOST_LOG is set
+};
+
+class Timer {
+public:
+    Timer() : _start(0), _running(false), _elapsed(0) {}
+    void start()    { if (!_running) { _start = host_clock_us(); _running = true; } }
+    void stop()     { _elapsed = read_us(); _running = false; }
+    void reset()    { _start = host_clock_us(); _elapsed = 0; }
+    int read_us()   { host_clock_tick(); return (int)(_elapsed + (_running ? host_clock_us() - _start : 0)); }
+    int read_ms()   { return read_us() / 1000; }
+
+private:
+    uint64_t _start;
+    bool _running;
+    uint64_t _elapsed;
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+#endif // HOST_MBED_H
@@ -0,0 +1,390 @@
+#include "bg96_parser.h"
+
+
+// Parse area of the caller's buffer pool, POOL_PARSE_BUF_SIZE bytes
+static char * _parsebuf = NULL;
+
+// Set by the +QIURC: "recv" URC, also when it arrives in the middle of another response
+static volatile bool _recv_urc_pending = false;
+
+static void onRecvUrc_BG96(void)
+{
+    _recv_urc_pending = true;
+}
+
+// ----------------------------------------------------------------
+// Functions: URC
+// ----------------------------------------------------------------
+
+void setUrcHandlers_BG96(ATCmdParser &parser)
+{
+    parser.oob("+QIURC: \"recv\"", callback(onRecvUrc_BG96));
+}
+
+void setParseBuffer_BG96(char * buf)
+{
+    _parsebuf = buf;
+}
+
+bool takeRecvUrc_BG96(void)
+{
+    bool pending = _recv_urc_pending;
+
+    _recv_urc_pending = false;
+    return pending;
+}
+
+// ----------------------------------------------------------------
+// Functions: Cat.M1 Status
+// ----------------------------------------------------------------
+
+int8_t checknSetApn_BG96(ATCmdParser &parser, const char * apn) // Configure Parameters of a TCP/IP Context
+{
+    char * resp_str = _parsebuf;
+
+    uint16_t i = 0;
+    char * search_pt = 0;
+
+    memset(resp_str, 0, POOL_PARSE_BUF_SIZE);
+
+    devlog("Checking APN...\r\n");
+
+    parser.send("AT+QICSGP=1");
+
+    // Advance only on a received byte: a timed out read must not leave a hole in resp_str
+    while(i < POOL_PARSE_BUF_SIZE - 1)
+    {
+        if(parser.read(&resp_str[i], 1) != 1)
+        {
+            break;
+        }
+        i++;
+        search_pt = strstr(resp_str, "OK\r\n");
+        if (search_pt != 0)
+        {
+            break;
+        }
+    }
+
+    // Raw reads bypass the OOB handlers, so pick up a data URC that arrived in between
+    if (strstr(resp_str, "+QIURC: \"recv\"") != 0)
+    {
+        _recv_urc_pending = true;
+    }
+
+    if (search_pt == 0)
+    {
+        devlog("APN response incomplete: %s\r\n", resp_str);
+        parser.flush();
+        return RET_NOK;
+    }
+
+    search_pt = strstr(resp_str, apn);
+    if (search_pt == 0)
+    {
+        devlog("Mismatched APN: %s\r\n", resp_str);
+        devlog("Storing APN %s...\r\n", apn);
+        if(!(parser.send("AT+QICSGP=1,%d,\"%s\",\"\",\"\",0", BG96_APN_PROTOCOL, apn) && parser.recv("OK")))
+        {
+            return RET_NOK; // failed
+        }
+    }
+    devlog("APN Check Done\r\n");
+
+    return RET_OK;
+}
+
+// ----------------------------------------------------------------
+// Functions: DNS
+// ----------------------------------------------------------------
+
+// ipstr receives at most ipstr_size - 1 characters; a longer address fails the lookup
+int8_t getIpAddressByName_BG96(ATCmdParser &parser, const char * name, char * ipstr, int ipstr_size)
+{
+    char ipfmt[40];
+    bool ok;
+    int  err, ipcount, dnsttl;
+
+    int8_t ret = RET_NOK;
+
+    if(ipstr_size < 2) {
+        return RET_NOK;
+    }
+    ipstr[0] = '\0';
+    sprintf(ipfmt, "+QIURC: \"dnsgip\",\"%%%d[^\"]\"", ipstr_size - 1);
+
+    ok = ( parser.send("AT+QIDNSGIP=1,\"%s\"", name)
+            && parser.recv("OK")
+            && parser.recv("+QIURC: \"dnsgip\",%d,%d,%d", &err, &ipcount, &dnsttl)
+            && err==0
+            && ipcount > 0
+        );
+
+    if( ok && parser.recv(ipfmt, ipstr) ) {                         //use the first DNS value
+        for( int i=0; i<ipcount-1; i++ )
+            parser.recv("+QIURC: \"dnsgip\",\"%*[^\"]\"");        //and discrard the rest  if >1
+
+        ret = RET_OK;
+    } else {
+        ipstr[0] = '\0';
+    }
+    return ret;
+}
+
+// ----------------------------------------------------------------
+// Functions: Cat.M1 PDP context
+// ----------------------------------------------------------------
+
+// ipstr receives at most ipstr_size - 1 characters; a longer address fails the query
+int8_t getIpAddress_BG96(ATCmdParser &parser, char * ipstr, int ipstr_size) // IPv4 or IPv6
+{
+    int8_t ret = RET_NOK;
+    int id, state, type; // not used
+    char ipfmt[40];
+
+    if(ipstr_size < 2) {
+        return RET_NOK;
+    }
+    ipstr[0] = '\0';
+    sprintf(ipfmt, "+QIACT: %%d,%%d,%%d,\"%%%d[^\"]\"", ipstr_size - 1);
+
+    parser.send("AT+QIACT?");
+    if(parser.recv(ipfmt, &id, &state, &type, ipstr)
+        && parser.recv("OK")) {
+        ret = RET_OK;
+    } else {
+        ipstr[0] = '\0';
+    }
+    return ret;
+}
+
+// ----------------------------------------------------------------
+// Functions: TCP/UDP socket service
+// ----------------------------------------------------------------
+
+int8_t sockOpenConnect_BG96(ATCmdParser &parser, const char * type, const char * addr, int port)
+{
+    int8_t ret = RET_NOK;  
+    int err = 1;
+    int id = 0;
+    
+    bool done = false;
+    Timer t;
+    
+    parser.set_timeout(BG96_CONNECT_TIMEOUT);
+    
+    if((strcmp(type, "TCP") != 0) && (strcmp(type, "UDP") != 0)) {        
+        return RET_NOK;
+    }
+
+    // A recv URC of an earlier socket must not pass for a reply on this one
+    _recv_urc_pending = false;
+    t.start();
+    
+    parser.send("AT+QIOPEN=1,%d,\"%s\",\"%s\",%d", id, type, addr, port);
+    do {        
+        done = (parser.recv("+QIOPEN: %d,%d", &id, &err) && (err == 0));        
+    } while(!done && t.read_ms() < BG96_CONNECT_TIMEOUT);
+
+    if(done) ret = RET_OK;
+
+    parser.set_timeout(BG96_DEFAULT_TIMEOUT);
+    parser.flush();
+    
+    return ret;
+}
+
+int8_t sockClose_BG96(ATCmdParser &parser)
+{
+    int8_t ret = RET_NOK;
+    int id = 0;
+    
+    parser.set_timeout(BG96_CONNECT_TIMEOUT);
+    
+    if(parser.send("AT+QICLOSE=%d", id) && parser.recv("OK")) {
+        ret = RET_OK;        
+    }
+    parser.set_timeout(BG96_DEFAULT_TIMEOUT);
+    
+    return ret;
+}
+
+int8_t sendData_BG96(ATCmdParser &parser, char * data, int len)
+{
+    int8_t ret = RET_NOK;
+    int id = 0;
+    bool done = false;
+    
+    parser.set_timeout(BG96_SEND_TIMEOUT);
+    
+    parser.send("AT+QISEND=%d,%d", id, len);
+    if( !done && parser.recv(">") )
+        done = (parser.write(data, len) <= 0);
+
+    if( !done )
+        done = parser.recv("SEND OK");    
+    
+    parser.set_timeout(BG96_DEFAULT_TIMEOUT);
+    
+    return ret;
+}
+
+int8_t checkRecvData_BG96(ATCmdParser &parser)
+{
+    int8_t ret = RET_NOK;
+    
+    // +QIURC: "recv" is an OOB handler, so it is caught inside any other response too.
+    // process_oob() returns at once when nothing is pending, but a line it has started
+    // must not time out between two UART chunks, or the rest of the URC is lost.
+    parser.set_timeout(BG96_RECV_TIMEOUT);
+    while(parser.process_oob());
+    parser.set_timeout(BG96_DEFAULT_TIMEOUT);
+    
+    if(takeRecvUrc_BG96()) ret = RET_OK;
+    return ret;
+}
+
+int8_t waitRecvData_BG96(ATCmdParser &parser, int timeout_ms)
+{
+    int8_t ret = RET_NOK;
+    Timer t;
+
+    t.start();
+    
+    while(t.read_ms() < timeout_ms) {
+        if(checkRecvData_BG96(parser) == RET_OK) {
+            ret = RET_OK;
+            break;
+        }
+    }
+    return ret;
+}
+
+// The payload is read as a null-terminated string of at most size - 1 bytes
+int8_t recvData_BG96(ATCmdParser &parser, char * data, int size, int * len)
+{
+    int8_t ret = RET_NOK;
+    int id = 0;
+    int recvCount = 0;
+
+    data[0] = '\0';
+    parser.set_timeout(BG96_RECV_TIMEOUT);
+
+    if( parser.send("AT+QIRD=%d,%d", id, size - 1) && parser.recv("+QIRD:%d\r\n",&recvCount) ) {
+        if(recvCount > 0 && recvCount < size) {
+            parser.getc();
+            if(parser.read(data, recvCount) == recvCount && parser.recv("OK")) {
+                data[recvCount] = '\0';
+                ret = RET_OK;
+            } else {
+                data[0] = '\0';
+                recvCount = 0;
+            }
+        } else {
+            recvCount = 0;  // nothing to read, or more than was asked for
+        }
+    }
+    parser.set_timeout(BG96_DEFAULT_TIMEOUT);
+    parser.flush();
+
+    // The read took what the URC announced, also a URC caught while waiting for +QIRD
+    _recv_urc_pending = false;
+    *len = recvCount;
+
+    return ret;
+}
+
+// ----------------------------------------------------------------
+// Functions: Cat.M1 GPS
+// ----------------------------------------------------------------
+
+// Reads "(-)ddd.ddd" without scanf float support, returns the end of the number or NULL
+const char * readFixed(const char * str, float *value)
+{
+    bool negative = false;
+    bool digits = false;
+    uint32_t whole = 0, frac = 0, scale = 1;
+
+    if(*str == '-') {
+        negative = true;
+        str++;
+    }
+    for(; *str >= '0' && *str <= '9'; str++) {
+        whole = whole * 10 + (*str - '0');
+        digits = true;
+    }
+    if(*str == '.') {
+        for(str++; *str >= '0' && *str <= '9'; str++) {
+            if(scale < 1000000) {
+                frac = frac * 10 + (*str - '0');
+                scale *= 10;
+            }
+            digits = true;
+        }
+    }
+    if(!digits) {
+        return NULL;
+    }
+
+    *value = (float)whole + (float)frac / scale;
+    if(negative) *value = -*value;
+    return str;
+}
+
+// +QGPSLOC: <UTC>,<lat>,<lon>,<hdop>,<altitude>,<fix>,<cog>,<spkm>,<spkn>,<date>,<nsat>
+int8_t parseGpsLocation_BG96(const char * str, gps_data *data)
+{
+    float * fields[] = { &data->utc, &data->lat, &data->lon, &data->hdop, &data->altitude };
+    float * motion[] = { &data->cog, &data->spkm, &data->spkn };
+    char * end;
+
+    for(int i=0; i<5; i++) {
+        if((str = readFixed(str, fields[i])) == NULL || *str++ != ',') return RET_NOK;
+    }
+    data->fix = strtol(str, &end, 10);
+    if(end == str || *end != ',') return RET_NOK;
+    str = end + 1;
+    for(int i=0; i<3; i++) {
+        if((str = readFixed(str, motion[i])) == NULL || *str++ != ',') return RET_NOK;
+    }
+    if(strlen(str) < 8 || str[6] != ',') return RET_NOK;
+    memcpy(data->date, str, 6);
+    data->date[6] = '\0';
+    str += 7;
+    data->nsat = strtol(str, &end, 10);
+    if(end == str || *end != '\0') return RET_NOK;
+
+    return RET_OK;
+}
+
+int8_t getGpsLocation_BG96(ATCmdParser &parser, gps_data *data)
+{
+    int8_t ret = RET_NOK;
+    char * _buf = _parsebuf;
+
+    bool ok = false;
+    Timer t;
+
+    // Structure init: GPS info
+    data->utc = data->lat = data->lon = data->hdop= data->altitude = data->cog = data->spkm = data->spkn = data->nsat=0.0;
+    data->fix=0;
+    memset(&data->date, 0x00, 7);
+
+    // timer start
+    t.start();
+
+    while( !ok && (t.read_ms() < BG96_CONNECT_TIMEOUT ) ) {
+        parser.flush();
+        parser.send((char*)"AT+QGPSLOC=2"); // MS-based mode
+        ok = parser.recv("+QGPSLOC: ");
+        if(ok) {
+            ok = parser.recv("%99s\r\n", _buf)
+                && parseGpsLocation_BG96(_buf, data) == RET_OK
+                && parser.recv("OK");
+        }
+    }
+
+    if(ok == true) ret = RET_OK;
+
+    return ret;
+}
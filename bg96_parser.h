@@ -0,0 +1,81 @@
+#ifndef BG96_PARSER_H
+#define BG96_PARSER_H
+
+#include "mbed.h"
+
+
+#define RET_OK                      1
+#define RET_NOK                     -1
+#define DEBUG_ENABLE                1
+#define DEBUG_DISABLE               0
+
+#define POOL_PARSE_BUF_SIZE         100         // AT response lines (APN, GPS)
+
+#define BG96_APN_PROTOCOL_IPv4      1
+#define BG96_APN_PROTOCOL_IPv6      2
+#define BG96_DEFAULT_TIMEOUT        1000
+#define BG96_CONNECT_TIMEOUT        15000
+#define BG96_SEND_TIMEOUT           500
+#define BG96_RECV_TIMEOUT           500
+
+#define BG96_APN_PROTOCOL           BG96_APN_PROTOCOL_IPv6
+
+#define CATM1_DEVICE_NAME_BG96      "BG96"
+#define DEVNAME                     CATM1_DEVICE_NAME_BG96
+
+#define devlog(f_, ...)             if(CATM1_DEVICE_DEBUG == DEBUG_ENABLE) { pc.printf("\r\n[%s] ", DEVNAME);  pc.printf((f_), ##__VA_ARGS__); }
+
+/* Debug message settings */
+#define CATM1_DEVICE_DEBUG          DEBUG_ENABLE
+
+extern Serial pc;
+
+// ============================= GPS =============================
+typedef struct gps_data_t {
+    float utc;      // hhmmss.sss
+    float lat;      // latitude. (-)dd.ddddd
+    float lon;      // longitude. (-)dd.ddddd
+    float hdop;     // Horizontal precision: 0.5-99.9
+    float altitude; // altitude of antenna from sea level (meters)
+    int fix;        // GNSS position mode 2=2D, 3=3D
+    float cog;      // Course Over Ground ddd.mm
+    float spkm;     // Speed over ground (Km/h) xxxx.x
+    float spkn;     // Speed over ground (knots) xxxx.x
+    char date[7];   // data: ddmmyy
+    int nsat;       // number of satellites 0-12
+} gps_data;
+// ===============================================================
+
+// AT response parsers. They only talk to the given parser, so UNITTESTS/ replays
+// recorded UART captures through them on the host.
+
+// Functions: Setup
+void setParseBuffer_BG96(char * buf);   // POOL_PARSE_BUF_SIZE bytes, used by the APN and GPS parsers
+
+// Functions: URC
+void setUrcHandlers_BG96(ATCmdParser &parser);
+bool takeRecvUrc_BG96(void);    // a +QIURC: "recv" arrived since the last call
+
+// Functions: Module Status
+int8_t checknSetApn_BG96(ATCmdParser &parser, const char * apn);
+
+// Functions: DNS
+int8_t getIpAddressByName_BG96(ATCmdParser &parser, const char * name, char * ipstr, int ipstr_size);
+
+// Functions: PDP context
+int8_t getIpAddress_BG96(ATCmdParser &parser, char * ipstr, int ipstr_size);
+
+// Functions: TCP/UDP Socket service
+int8_t sockOpenConnect_BG96(ATCmdParser &parser, const char * type, const char * addr, int port);
+int8_t sockClose_BG96(ATCmdParser &parser);
+int8_t sendData_BG96(ATCmdParser &parser, char * data, int len);
+int8_t checkRecvData_BG96(ATCmdParser &parser);
+int8_t waitRecvData_BG96(ATCmdParser &parser, int timeout_ms);
+int8_t recvData_BG96(ATCmdParser &parser, char * data, int size, int * len);
+
+// Functions: GPS
+int8_t getGpsLocation_BG96(ATCmdParser &parser, gps_data *data);
+int8_t parseGpsLocation_BG96(const char * str, gps_data *data);
+const char * readFixed(const char * str, float *value);
+
+#endif // BG96_PARSER_H
@@ -1,33 +1,26 @@
 #include <string>
+#include <new>
 #include "mbed.h"
+#include "nvstore.h"
+#include "bg96_parser.h"
 
 
-#define RET_OK                      1
-#define RET_NOK                     -1
-#define DEBUG_ENABLE                1
-#define DEBUG_DISABLE               0
 #define ON                          1
 #define OFF                         0
 
-#define MAX_BUF_SIZE                1024
+#define MAX_BUF_SIZE                256
 
-#define BG96_APN_PROTOCOL_IPv4      1
-#define BG96_APN_PROTOCOL_IPv6      2
-#define BG96_DEFAULT_TIMEOUT        1000
-#define BG96_CONNECT_TIMEOUT        15000
-#define BG96_SEND_TIMEOUT           500
-#define BG96_RECV_TIMEOUT           500
+/* Buffer pool: the send frame, and one area shared by the receive and parse paths (single thread) */
+#define POOL_SEND_BUF_SIZE          64          // R+G / D report frames
+#define POOL_RECV_BUF_SIZE          MAX_BUF_SIZE  // AT+QIRD payload, also bounds the read length
+
+#define STACK_STATS_MAX_THREADS     8
 
-#define BG96_APN_PROTOCOL           BG96_APN_PROTOCOL_IPv6
 #define BG96_DEFAULT_BAUD_RATE      115200
 #define BG96_PARSER_DELIMITER       "\r\n"
 
 #define CATM1_APN_SKT               "lte-internet.sktelecom.com"
 
-#define CATM1_DEVICE_NAME_BG96      "BG96"
-#define DEVNAME                     CATM1_DEVICE_NAME_BG96
-
-#define devlog(f_, ...)             if(CATM1_DEVICE_DEBUG == DEBUG_ENABLE) { pc.printf("\r\n[%s] ", DEVNAME);  pc.printf((f_), ##__VA_ARGS__); }
 #define myprintf(f_, ...)           {pc.printf("\r\n[MAIN] ");  pc.printf((f_), ##__VA_ARGS__);}
 
 /* Pin configuraiton */
@@ -43,22 +36,50 @@
 
 /* Debug message settings */
 #define BG96_PARSER_DEBUG           DEBUG_DISABLE
-#define CATM1_DEVICE_DEBUG          DEBUG_ENABLE 
-
-// ============================= GPS =============================
-typedef struct gps_data_t {
-    float utc;      // hhmmss.sss
-    float lat;      // latitude. (-)dd.ddddd
-    float lon;      // longitude. (-)dd.ddddd
-    float hdop;     // Horizontal precision: 0.5-99.9
-    float altitude; // altitude of antenna from sea level (meters) 
-    int fix;        // GNSS position mode 2=2D, 3=3D
-    float cog;      // Course Over Ground ddd.mm
-    float spkm;     // Speed over ground (Km/h) xxxx.x
-    float spkn;     // Speed over ground (knots) xxxx.x
-    char date[7];   // data: ddmmyy
-    int nsat;       // number of satellites 0-12
-} gps_data;
+
+// =========================== Session ===========================
+#define SESSION_MAGIC               0x53455332  // "SES2"
+#define SESSION_NODENAME_SIZE       17
+#define SESSION_TOKEN_SIZE          17
+#define SESSION_TOKEN_CHARS         "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+#define SESSION_NVSTORE_KEY         (NVSTORE_NUM_PREDEFINED_KEYS)
+#define SESSION_GPS_EPSILON         0.0005f     // ~50m, below this the fix is not re-reported
+#define SESSION_REPLY_TIMEOUT       5000
+
+typedef struct session_data_t {
+    uint32_t magic;
+    char nodename[SESSION_NODENAME_SIZE];   // node the token was issued to
+    char token[SESSION_TOKEN_SIZE];         // token returned with S:OK:<token>
+    float lat;      // last reported latitude
+    float lon;      // last reported longitude
+    uint8_t has_fix;    // lat/lon hold a real GPS fix (not reported without one)
+} session_data;
+// ===============================================================
+
+// ======================= Sampling config =======================
+#define CONFIG_MAGIC                0x43464732  // "CFG2"
+#define CONFIG_NVSTORE_KEY          (NVSTORE_NUM_PREDEFINED_KEYS + 1)
+
+#define CONFIG_DEFAULT_WINDOW       1024
+#define CONFIG_DEFAULT_LEVEL        80          // 0.8 of ADC full scale
+#define CONFIG_DEFAULT_TRUST        20          // 20% trust range
+#define CONFIG_DEFAULT_HEARTBEAT    60          // windows between unconditional reports
+
+#define CONFIG_PERIOD_MIN           1
+#define CONFIG_PERIOD_MAX           1000
+#define CONFIG_WINDOW_MIN           16
+#define CONFIG_WINDOW_MAX           4096
+#define CONFIG_HEARTBEAT_MIN        1
+#define CONFIG_HEARTBEAT_MAX        1000
+
+typedef struct sampling_config_t {
+    uint32_t magic;
+    uint16_t period_ms; // wait between ADC samples (ms)
+    uint16_t window;    // samples per window
+    uint16_t heartbeat; // windows without a change before a D: report is sent anyway
+    uint8_t level;      // ADC trigger level, percent of full scale
+    uint8_t trust;      // percent of the window above level to report ON
+} sampling_config;
 // ===============================================================
 
 // Functions: Module Status
@@ -66,39 +87,61 @@ void waitCatM1Ready(void);
 int8_t setEchoStatus_BG96(bool onoff);
 int8_t getUsimStatus_BG96(void);
 int8_t getNetworkStatus_BG96(void);
-int8_t checknSetApn_BG96(const char * apn);
 int8_t getFirmwareVersion_BG96(char * version);
 int8_t getImeiNumber_BG96(char * imei);
 
 // Functions: GPS
 int8_t setGpsOnOff_BG96(bool onoff);
-int8_t getGpsLocation_BG96(gps_data *data);
-
-// Functions: DNS
-int8_t getIpAddressByName_BG96(const char * name, char * ipstr);
 
 // Functions: PDP context
 int8_t setContextActivate_BG96(void);   // Activate a PDP Context
 int8_t setContextDeactivate_BG96(void); // Deactivate a PDP Context
-int8_t getIpAddress_BG96(char * ipstr);
 
 // Functions: TCP
 // int8_t sendTCPGET();
 
 
-// Functions: TCP/UDP Socket service
-int8_t sockOpenConnect_BG96(const char * type, const char * addr, int port);
-int8_t sockClose_BG96(void);
-int8_t sendData_BG96(char * data, int len);
-int8_t checkRecvData_BG96(void);
-int8_t recvData_BG96(char * data, int * len);
+// Functions: Server session
+int8_t loadSession(session_data *session);
+int8_t saveSession(const session_data *session);
+int8_t clearSession(session_data *session);
+bool isSessionCurrent(const session_data *session, const char * nodename, const gps_data *gps);
+int8_t registerSession(const char * nodename, const gps_data *gps, session_data *session);
+
+// Functions: Downlink command channel
+void setDefaultConfig(sampling_config *config);
+int8_t loadConfig(sampling_config *config);
+int8_t saveConfig(const sampling_config *config);
+int8_t parseConfigFrame(const char * frame, sampling_config *config);
+int8_t checkDownlink(const char * reply, sampling_config *config);
 
+// Functions: Report formatting
+char * appendStr(char * dst, const char * str);
+char * appendUint(char * dst, uint32_t value);
+char * appendFixed(char * dst, float value, int decimals);
+const char * fixedStr(char * dst, float value, int decimals);
+
+// Functions: Memory statistics
+void printStackStats(void);
 
 Serial pc(USBTX, USBRX); // tx, rx
 
 UARTSerial *_serial;
 ATCmdParser *_parser;
 
+// Static storage for the serial device and AT parser (no heap allocation)
+MBED_ALIGN(8) static uint8_t _serial_mem[sizeof(UARTSerial)];
+MBED_ALIGN(8) static uint8_t _parser_mem[sizeof(ATCmdParser)];
+
+// Buffer pool. A reply is read after the frame was sent, so send keeps its own buffer.
+// The parse paths (APN, GPS) never run while a reply is still in use, so they reuse the receive area.
+static char _sendbuf[POOL_SEND_BUF_SIZE];
+static union {
+    char recv[POOL_RECV_BUF_SIZE];
+    char parse[POOL_PARSE_BUF_SIZE];
+} _pool;
+static char * const _recvbuf = _pool.recv;
+
 DigitalOut _RESET_BG96(MBED_CONF_IOTSHIELD_CATM1_RESET);
 DigitalOut _PWRKEY_BG96(MBED_CONF_IOTSHIELD_CATM1_PWRKEY);
 DigitalOut StatLED(LED1);
@@ -118,15 +161,17 @@ void serialPcInit(void)
 
 void serialDeviceInit(PinName tx, PinName rx, int baudrate) 
 {        
-    _serial = new UARTSerial(tx, rx, baudrate);    
+    _serial = new (_serial_mem) UARTSerial(tx, rx, baudrate);    
 }
 
 void serialAtParserInit(const char *delimiter, bool debug_en)
 {
-    _parser = new ATCmdParser(_serial);    
+    _parser = new (_parser_mem) ATCmdParser(_serial);    
     _parser->debug_on(debug_en);
     _parser->set_delimiter(delimiter);    
     _parser->set_timeout(BG96_DEFAULT_TIMEOUT);
+    setUrcHandlers_BG96(*_parser);
+    setParseBuffer_BG96(_pool.parse);
 }
 
 void catm1DeviceInit(void)
@@ -163,11 +208,22 @@ void catm1DeviceReset_BG96(void)
 int main()
 {
     char nodename[] = "01258038c120358x";
+    gps_data gps_info;
+    const gps_data *gps_fix = &gps_info;    // NULL when no GPS fix is available
+    session_data session;                   // server session, token empty until registered
+    sampling_config config;         // applied to the running window
+    sampling_config pendingConfig;  // updated by C: frames, applied at the next window
 
     // Device Init
     serialPcInit();    
     catm1DeviceInit();
     
+    if(loadConfig(&config) != RET_OK) {
+        setDefaultConfig(&config);
+    }
+    pendingConfig = config;
+    memset(&session, 0, sizeof(session_data));
+    
     #ifndef PASS_CATM1
     myprintf("Waiting for Cat.M1 Module Ready...\r\n");
     
@@ -189,39 +245,36 @@ int main()
     setEchoStatus_BG96(OFF);
     getUsimStatus_BG96();
     getNetworkStatus_BG96();
-    checknSetApn_BG96(CATM1_APN_SKT);
+    checknSetApn_BG96(*_parser, CATM1_APN_SKT);
 
 
     #ifdef GPS_ENABLED
     // ===== GPS Read =====
-    gps_data gps_info;
-
     if(setGpsOnOff_BG96(ON) != RET_OK) {
         myprintf("GPS Init failed\r\n");
         return 0;
     }
 
-    if(getGpsLocation_BG96(&gps_info) != RET_OK) {
+    if(getGpsLocation_BG96(*_parser, &gps_info) != RET_OK) {
         myprintf("GPS Fetch failed\r\n");
-        // return 0;
+        gps_fix = NULL;     // keep the stored fix, never report 0,0
     }
 
+    char fixbuf[16];
     myprintf("Get GPS information >>>");
-    myprintf("gps_info - utc: %6.3f", gps_info.utc)             // utc: hhmmss.sss
-    myprintf("gps_info - lat: %2.5f", gps_info.lat)             // latitude: (-)dd.ddddd
-    myprintf("gps_info - lon: %2.5f", gps_info.lon)             // longitude: (-)dd.ddddd
-    myprintf("gps_info - hdop: %2.1f", gps_info.hdop)           // Horizontal precision: 0.5-99.9
-    myprintf("gps_info - altitude: %2.1f", gps_info.altitude)   // altitude of antenna from sea level (meters)
+    myprintf("gps_info - utc: %s", fixedStr(fixbuf, gps_info.utc, 3))             // utc: hhmmss.sss
+    myprintf("gps_info - lat: %s", fixedStr(fixbuf, gps_info.lat, 5))             // latitude: (-)dd.ddddd
+    myprintf("gps_info - lon: %s", fixedStr(fixbuf, gps_info.lon, 5))             // longitude: (-)dd.ddddd
+    myprintf("gps_info - hdop: %s", fixedStr(fixbuf, gps_info.hdop, 1))           // Horizontal precision: 0.5-99.9
+    myprintf("gps_info - altitude: %s", fixedStr(fixbuf, gps_info.altitude, 1))   // altitude of antenna from sea level (meters)
     myprintf("gps_info - fix: %d", gps_info.fix)                // GNSS position mode: 2=2D, 3=3D
-    myprintf("gps_info - cog: %3.2f", gps_info.cog)             // Course Over Ground: ddd.mm
-    myprintf("gps_info - spkm: %4.1f", gps_info.spkm)           // Speed over ground (Km/h): xxxx.x
-    myprintf("gps_info - spkn: %4.1f", gps_info.spkn)           // Speed over ground (knots): xxxx.x            
+    myprintf("gps_info - cog: %s", fixedStr(fixbuf, gps_info.cog, 2))             // Course Over Ground: ddd.mm
+    myprintf("gps_info - spkm: %s", fixedStr(fixbuf, gps_info.spkm, 1))           // Speed over ground (Km/h): xxxx.x
+    myprintf("gps_info - spkn: %s", fixedStr(fixbuf, gps_info.spkn, 1))           // Speed over ground (knots): xxxx.x            
     myprintf("gps_info - date: %s", gps_info.date)              // data: ddmmyy
     myprintf("gps_info - nsat: %d\r\n", gps_info.nsat)          // number of satellites: 0-12
     // <===== GPS ======
     #else
-    gps_data gps_info;
-
     // Set with custom value
     gps_info.lat = 37.4819722;
     gps_info.lon = 126.883329;
@@ -229,68 +282,25 @@ int main()
 
     setContextActivate_BG96();
 
-    // TCP Client: Send and Receive
-    int8_t ret;
-    ret = sockOpenConnect_BG96("TCP", dest_ip, dest_port);
-
-    if(ret != RET_OK) {
-        myprintf("sockOpenConnect Failed\r\n");
-        return 0;
-    }
-
     // ------------------------------------------------------
-    // Register hostname
-    char sendbuf[1024] = {0, };
-    sprintf(sendbuf, "R:%s", nodename);
-    ret = sendData_BG96(sendbuf, strlen(sendbuf));
-    myprintf("dataSend [%d]: %s\r\n", strlen(sendbuf), sendbuf);
-    wait_ms(1000);
-
-    if(!ret) {
-        myprintf("dataSend failed\r\n");
-        return 0;
-    }
-    wait_ms(1000);
-
-    if(checkRecvData_BG96() != RET_OK) {
-        myprintf("data Recv failed\r\n");
-        return 0;
-    }
-
-    char recvbuf[1024] = {0, };
-    int recvlen;
-    recvData_BG96(recvbuf, &recvlen);
-    myprintf("dataRecv [%d]: %s\r\n", recvlen, recvbuf);
-
-    if(strlen(recvbuf) >= 4 && strncmp("S:OK", recvbuf, 4)) {
-        myprintf("Server registration failed\r\n");
-        return 0;
-    }
-
-    
-    // -------------------------------------------------------
-    // Register GPS
-    // strcpy(sendbuf, "G:01258038c120358x:37.490762,126.8844066");
-    sprintf(sendbuf, "G:%s:%2.5f,%2.5f", nodename, gps_info.lat, gps_info.lon);
-    ret = sendData_BG96(sendbuf, strlen(sendbuf));
-    myprintf("dataSend [%d]: %s\r\n", strlen(sendbuf), sendbuf);
-    wait_ms(500);
-
-    if(!ret) {
-        myprintf("dataSend failed\r\n");
-        return 0;
-    }
-
-    recvData_BG96(recvbuf, &recvlen);
-    myprintf("dataRecv [%d]: %s\r\n", recvlen, recvbuf);
+    // Register hostname and GPS, unless the stored session is still current.
+    // The token is sent with every D: frame, so the server can still reject it later.
+    if(loadSession(&session) == RET_OK && isSessionCurrent(&session, nodename, gps_fix)) {
+        myprintf("Resuming session %s\r\n", session.token);
+    } else {
+        if(registerSession(nodename, gps_fix, &session) != RET_OK) {
+            myprintf("Server registration failed\r\n");
+            return 0;
+        }
 
-    if(strlen(recvbuf) >= 4 && strncmp("S:OK", recvbuf, 4)) {
-        myprintf("Server registration failed\r\n");
-        return 0;
+        if(session.token[0] != '\0' && saveSession(&session) != RET_OK) {
+            myprintf("Session store failed\r\n");
+        }
+        myprintf("Success registering\r\n");
+        
+        checkDownlink(_recvbuf, &pendingConfig);    // registration reply may carry C: frames
     }
-    sockClose_BG96();
-
-    myprintf("Success registering\r\n");
+    printStackStats();
     #endif // -> #ifndef PASS_CATM1
     
     _parser->debug_on(DEBUG_DISABLE);
@@ -302,38 +312,59 @@ int main()
 
     bool beforeUpperThreshold = true, nowResult;  // before True for first initializing
     int cycle = 1;
+    int idleWindows = 0;    // windows since the last D: report
     int sumThreshold = 0;
-    float reportValue = 0.0f;
+    int8_t ret;
+    int recvlen;
 
     while(1) {
-        for(int i=0; i<1024; i++) {
-            sumThreshold += (int)(ArduinoTrigger.read() > 0.8f);
-
-            #ifdef ENAK_DEVELOPING
-            wait_ms(5);
-            #else
-            wait_ms(10);
-            #endif
+        // Apply downlink changes only at the window boundary
+        if(memcmp(&config, &pendingConfig, sizeof(sampling_config)) != 0) {
+            config = pendingConfig;
+            myprintf("Config applied: period %d ms, window %d, level %d%%, trust %d%%, heartbeat %d",
+                     config.period_ms, config.window, config.level, config.trust, config.heartbeat);
+            
+            // No socket is open here, so a flash erase cannot drop UART bytes of an AT exchange
+            if(saveConfig(&config) != RET_OK) {
+                myprintf("Config store failed\r\n");
+            }
+        }
+        
+        uint16_t level_u16 = (uint16_t)(config.level * 0xFFFFUL / 100);
+        
+        for(int i=0; i<config.window; i++) {
+            sumThreshold += (int)(ArduinoTrigger.read_u16() > level_u16);
+            wait_ms(config.period_ms);
         }
 
-        myprintf("Cycle %d: %d/1024 (%.2f%%)", cycle, sumThreshold, sumThreshold/1024.0f * 100);
+        int percent = sumThreshold * 10000 / config.window;
+        myprintf("Cycle %d: %d/%d (%d.%02d%%)", cycle, sumThreshold, config.window, percent / 100, percent % 100);
 
-        nowResult = sumThreshold >= 1024 * 0.2;  // 20% trust range
+        nowResult = sumThreshold * 100 >= config.window * config.trust;  // trust range
 
-        if(nowResult != beforeUpperThreshold) {  // send only when value changed
-            // char sendbuf[1024];
-            // int8_t ret;
-            ret = sockOpenConnect_BG96("TCP", dest_ip, dest_port);
+        idleWindows++;
+        
+        // send when value changed, or as a heartbeat so the server can reach a stable node with C: frames
+        if(nowResult != beforeUpperThreshold || idleWindows >= config.heartbeat) {
+            idleWindows = 0;
+            ret = sockOpenConnect_BG96(*_parser, "TCP", dest_ip, dest_port);
             if(!ret) {
                 myprintf("dataSockOpen failed\r\n");
 
-                sockClose_BG96();
+                sockClose_BG96(*_parser);
                 continue;
             }
 
-            sprintf(sendbuf, "D:%s:%.2f", nodename, nowResult? sumThreshold/1024.0f: 0.0f);
-            ret = sendData_BG96(sendbuf, strlen(sendbuf));
-            myprintf("dataSend [%d]: %s\r\n", strlen(sendbuf), sendbuf);
+            char * p = appendStr(_sendbuf, "D:");
+            p = appendStr(p, nodename);
+            p = appendStr(p, ":");
+            p = appendFixed(p, nowResult? (float)sumThreshold / config.window: 0.0f, 2);
+            if(session.token[0] != '\0') {
+                p = appendStr(p, ":");
+                p = appendStr(p, session.token);
+            }
+            ret = sendData_BG96(*_parser, _sendbuf, p - _sendbuf);
+            myprintf("dataSend [%d]: %s\r\n", p - _sendbuf, _sendbuf);
             wait_ms(500);
 
             if(!ret) {
@@ -341,17 +372,24 @@ int main()
                 return 0;
             }
 
-            // int recvlen;
-            // char recvbuf[1024];
-            for(int i=0; i < sizeof(recvbuf) / sizeof(char); i++) recvbuf[i] = 0;
-
-            recvData_BG96(recvbuf, &recvlen);
-            myprintf("dataRecv [%d]: %s\r\n", recvlen, recvbuf);
+            recvData_BG96(*_parser, _recvbuf, POOL_RECV_BUF_SIZE, &recvlen);
+            myprintf("dataRecv [%d]: %s\r\n", recvlen, _recvbuf);
 
-            if(strlen(recvbuf) >= 4 && strncmp("S:OK", recvbuf, 4)) {
-                myprintf("Cycle %d: Server registration failed\r\n", cycle);
+            bool rejected = (strlen(_recvbuf) >= 4 && strncmp("S:OK", _recvbuf, 4));
+            checkDownlink(_recvbuf, &pendingConfig);
+            sockClose_BG96(*_parser);
+            
+            if(rejected) {
+                // Server lost or refused the session: drop the cached one and register again
+                myprintf("Cycle %d: Session rejected, registering again\r\n", cycle);
+                clearSession(&session);
+                if(registerSession(nodename, gps_fix, &session) != RET_OK) {
+                    myprintf("Cycle %d: Server registration failed\r\n", cycle);
+                } else if(session.token[0] != '\0' && saveSession(&session) != RET_OK) {
+                    myprintf("Session store failed\r\n");
+                }
             }
-            sockClose_BG96();
+            printStackStats();
         }
 
         beforeUpperThreshold = nowResult;
@@ -445,44 +483,6 @@ int8_t getNetworkStatus_BG96(void)
     return ret;
 }
 
-int8_t checknSetApn_BG96(const char * apn) // Configure Parameters of a TCP/IP Context
-{       
-    char resp_str[100];
-    
-    uint16_t i = 0;
-    char * search_pt;
-    
-    memset(resp_str, 0, sizeof(resp_str));
-    
-    devlog("Checking APN...\r\n");
-    
-    _parser->send("AT+QICSGP=1");
-    
-    while(1)
-    {
-        _parser->read(&resp_str[i++], 1);        
-        search_pt = strstr(resp_str, "OK\r\n");
-        if (search_pt != 0)
-        {
-            break;
-        }
-    }
-    
-    search_pt = strstr(resp_str, apn);
-    if (search_pt == 0)
-    {
-        devlog("Mismatched APN: %s\r\n", resp_str);
-        devlog("Storing APN %s...\r\n", apn);
-        if(!(_parser->send("AT+QICSGP=1,%d,\"%s\",\"\",\"\",0", BG96_APN_PROTOCOL, apn) && _parser->recv("OK")))
-        {
-            return RET_NOK; // failed
-        }
-    }    
-    devlog("APN Check Done\r\n");    
-    
-    return RET_OK;
-}
-
 int8_t getFirmwareVersion_BG96(char * version)
 {
     int8_t ret = RET_NOK;
@@ -504,30 +504,6 @@ int8_t getImeiNumber_BG96(char * imei)
     return ret;
 }
 
-int8_t getIpAddressByName_BG96(const char * name, char * ipstr)
-{
-    char buf2[50];
-    bool ok;
-    int  err, ipcount, dnsttl;
-
-    int8_t ret = RET_NOK;
-
-    ok = ( _parser->send("AT+QIDNSGIP=1,\"%s\"", name)
-            && _parser->recv("OK") 
-            && _parser->recv("+QIURC: \"dnsgip\",%d,%d,%d", &err, &ipcount, &dnsttl) 
-            && err==0 
-            && ipcount > 0
-        ); 
-
-    if( ok ) {        
-        _parser->recv("+QIURC: \"dnsgip\",\"%[^\"]\"", ipstr);       //use the first DNS value
-        for( int i=0; i<ipcount-1; i++ )
-            _parser->recv("+QIURC: \"dnsgip\",\"%[^\"]\"", buf2);   //and discrard the rest  if >1 
-            
-        ret = RET_OK;    
-    }        
-    return ret;
-}
 // ----------------------------------------------------------------
 // Functions: Cat.M1 PDP context activate / deactivate
 // ----------------------------------------------------------------
@@ -560,132 +536,343 @@ int8_t setContextDeactivate_BG96(void) // Deactivate a PDP Context
     return ret;
 }
 
-int8_t getIpAddress_BG96(char * ipstr) // IPv4 or IPv6
-{
-    int8_t ret = RET_NOK;    
-    int id, state, type; // not used    
-
-    _parser->send("AT+QIACT?");
-    if(_parser->recv("+QIACT: %d,%d,%d,\"%[^\"]\"", &id, &state, &type, ipstr)
-        && _parser->recv("OK")) {        
-        ret = RET_OK;
-    } 
-    return ret;
-}
-
 // ----------------------------------------------------------------
-// Functions: TCP/UDP socket service
+// Functions: Server session
 // ----------------------------------------------------------------
 
-int8_t sockOpenConnect_BG96(const char * type, const char * addr, int port)
+int8_t loadSession(session_data *session)
 {
-    int8_t ret = RET_NOK;  
-    int err = 1;
-    int id = 0;
-    
-    bool done = false;
-    Timer t;
+    int8_t ret = RET_NOK;
+    uint16_t actual_size = 0;
+    NVStore &nvstore = NVStore::get_instance();
     
-    _parser->set_timeout(BG96_CONNECT_TIMEOUT);
+    memset(session, 0, sizeof(session_data));
     
-    if((strcmp(type, "TCP") != 0) && (strcmp(type, "UDP") != 0)) {        
-        return RET_NOK;
+    if(nvstore.init() == NVSTORE_SUCCESS
+        && nvstore.get(SESSION_NVSTORE_KEY, sizeof(session_data), session, actual_size) == NVSTORE_SUCCESS
+        && actual_size == sizeof(session_data)
+        && session->magic == SESSION_MAGIC) {
+        ret = RET_OK;
+    } else {
+        memset(session, 0, sizeof(session_data));
     }
+    return ret;
+}
 
-    t.start();
-    
-    _parser->send("AT+QIOPEN=1,%d,\"%s\",\"%s\",%d", id, type, addr, port);
-    do {        
-        done = (_parser->recv("+QIOPEN: %d,%d", &id, &err) && (err == 0));        
-    } while(!done && t.read_ms() < BG96_CONNECT_TIMEOUT);
-
-    if(done) ret = RET_OK;
-
-    _parser->set_timeout(BG96_DEFAULT_TIMEOUT);
-    _parser->flush();
+int8_t saveSession(const session_data *session)
+{
+    int8_t ret = RET_NOK;
+    NVStore &nvstore = NVStore::get_instance();
     
+    if(nvstore.init() == NVSTORE_SUCCESS
+        && nvstore.set(SESSION_NVSTORE_KEY, sizeof(session_data), session) == NVSTORE_SUCCESS) {
+        ret = RET_OK;
+    }
     return ret;
 }
 
-int8_t sockClose_BG96(void)
+// Removes the stored record and drops the token; the last fix is kept for re-registration
+int8_t clearSession(session_data *session)
 {
     int8_t ret = RET_NOK;
-    int id = 0;
+    NVStore &nvstore = NVStore::get_instance();
     
-    _parser->set_timeout(BG96_CONNECT_TIMEOUT);
+    session->token[0] = '\0';
     
-    if(_parser->send("AT+QICLOSE=%d", id) && _parser->recv("OK")) {
-        ret = RET_OK;        
+    if(nvstore.init() == NVSTORE_SUCCESS && nvstore.remove(SESSION_NVSTORE_KEY) == NVSTORE_SUCCESS) {
+        ret = RET_OK;
     }
-    _parser->set_timeout(BG96_DEFAULT_TIMEOUT);
-    
     return ret;
 }
 
-int8_t sendData_BG96(char * data, int len)
+// gps is NULL when no fix is available: the stored fix is then trusted as is
+bool isSessionCurrent(const session_data *session, const char * nodename, const gps_data *gps)
 {
-    int8_t ret = RET_NOK;
-    int id = 0;
-    bool done = false;
+    if(session->token[0] == '\0' || strcmp(session->nodename, nodename) != 0) {
+        return false;
+    }
     
-    _parser->set_timeout(BG96_SEND_TIMEOUT);
+    if(gps == NULL) {
+        return true;
+    }
     
-    _parser->send("AT+QISEND=%d,%ld", id, len);
-    if( !done && _parser->recv(">") )
-        done = (_parser->write(data, len) <= 0);
+    return session->has_fix
+        && (fabsf(session->lat - gps->lat) < SESSION_GPS_EPSILON)
+        && (fabsf(session->lon - gps->lon) < SESSION_GPS_EPSILON);
+}
 
-    if( !done )
-        done = _parser->recv("SEND OK");    
+// Sends a single combined R+G frame and stores the token of the "S:OK[:<token>]" reply.
+// A server that answers with a bare "S:OK" leaves the token empty, so the next boot registers again.
+// Without a GPS fix (gps == NULL) the fix stored in session is reported, or a plain R: frame if there is none.
+int8_t registerSession(const char * nodename, const gps_data *gps, session_data *session)
+{
+    int8_t ret = RET_NOK;
+    char * p;
+    int recvlen = 0;
+    bool has_fix = true;
+    float lat = 0.0f, lon = 0.0f;
+    
+    if(gps != NULL) {
+        lat = gps->lat;
+        lon = gps->lon;
+    } else if(session->has_fix && strcmp(session->nodename, nodename) == 0) {
+        lat = session->lat;
+        lon = session->lon;
+    } else {
+        has_fix = false;
+    }
     
-    _parser->set_timeout(BG96_DEFAULT_TIMEOUT);
+    if(sockOpenConnect_BG96(*_parser, "TCP", dest_ip, dest_port) != RET_OK) {
+        myprintf("sockOpenConnect Failed\r\n");
+        return RET_NOK;
+    }
+    
+    if(has_fix) {
+        p = appendStr(_sendbuf, "R+G:");
+        p = appendStr(p, nodename);
+        p = appendStr(p, ":");
+        p = appendFixed(p, lat, 5);
+        p = appendStr(p, ",");
+        p = appendFixed(p, lon, 5);
+    } else {
+        p = appendStr(_sendbuf, "R:");
+        p = appendStr(p, nodename);
+    }
+    sendData_BG96(*_parser, _sendbuf, p - _sendbuf);
+    myprintf("dataSend [%d]: %s\r\n", p - _sendbuf, _sendbuf);
+    
+    if(waitRecvData_BG96(*_parser, SESSION_REPLY_TIMEOUT) == RET_OK
+        && recvData_BG96(*_parser, _recvbuf, POOL_RECV_BUF_SIZE, &recvlen) == RET_OK) {
+        myprintf("dataRecv [%d]: %s\r\n", recvlen, _recvbuf);
+        
+        const char * token = &_recvbuf[5];
+        size_t toklen = 0;
+        
+        // A token that would be cut short is rejected: a wrong token fails every later D: report
+        if(strncmp("S:OK:", _recvbuf, 5) == 0) {
+            toklen = strspn(token, SESSION_TOKEN_CHARS);
+            if(toklen == 0 || toklen >= SESSION_TOKEN_SIZE
+                || (token[toklen] != '\0' && token[toklen] != '\r' && token[toklen] != '\n')) {
+                myprintf("Invalid session token: %s\r\n", token);
+                sockClose_BG96(*_parser);
+                return RET_NOK;
+            }
+        }
+        
+        if(strncmp("S:OK", _recvbuf, 4) == 0) {
+            memset(session, 0, sizeof(session_data));
+            session->magic = SESSION_MAGIC;
+            strncpy(session->nodename, nodename, SESSION_NODENAME_SIZE - 1);
+            memcpy(session->token, token, toklen);
+            session->lat = lat;
+            session->lon = lon;
+            session->has_fix = has_fix;
+            ret = RET_OK;
+        }
+    }
+    sockClose_BG96(*_parser);
     
     return ret;
 }
 
-int8_t checkRecvData_BG96(void)
+// ----------------------------------------------------------------
+// Functions: Downlink command channel
+// ----------------------------------------------------------------
+
+void setDefaultConfig(sampling_config *config)
+{
+    memset(config, 0, sizeof(sampling_config));
+    config->magic = CONFIG_MAGIC;
+    #ifdef ENAK_DEVELOPING
+    config->period_ms = 5;
+    #else
+    config->period_ms = 10;
+    #endif
+    config->window = CONFIG_DEFAULT_WINDOW;
+    config->level = CONFIG_DEFAULT_LEVEL;
+    config->trust = CONFIG_DEFAULT_TRUST;
+    config->heartbeat = CONFIG_DEFAULT_HEARTBEAT;
+}
+
+int8_t loadConfig(sampling_config *config)
 {
     int8_t ret = RET_NOK;
-    int id = 0;
-    char cmd[20];
-    
-    bool received = false;
+    uint16_t actual_size = 0;
+    NVStore &nvstore = NVStore::get_instance();
+    
+    if(nvstore.init() == NVSTORE_SUCCESS
+        && nvstore.get(CONFIG_NVSTORE_KEY, sizeof(sampling_config), config, actual_size) == NVSTORE_SUCCESS
+        && actual_size == sizeof(sampling_config)
+        && config->magic == CONFIG_MAGIC) {
+        devlog("Stored config loaded\r\n");
+        ret = RET_OK;
+    }
+    return ret;
+}
 
-    sprintf(cmd, "+QIURC: \"recv\",%d", id);
-    _parser->set_timeout(1);
-    received = _parser->recv(cmd);
-    _parser->set_timeout(BG96_DEFAULT_TIMEOUT);
+int8_t saveConfig(const sampling_config *config)
+{
+    int8_t ret = RET_NOK;
+    NVStore &nvstore = NVStore::get_instance();
     
-    if(received) ret = RET_OK;    
+    if(nvstore.init() == NVSTORE_SUCCESS
+        && nvstore.set(CONFIG_NVSTORE_KEY, sizeof(sampling_config), config) == NVSTORE_SUCCESS) {
+        ret = RET_OK;
+    }
     return ret;
 }
 
-int8_t recvData_BG96(char * data, int * len)
+// C:<key>=<value>[,<key>=<value>...]
+// keys: period (ms), window (samples), level (%), trust (%), heartbeat (windows)
+// An unknown key or out of range value rejects the whole frame.
+int8_t parseConfigFrame(const char * frame, sampling_config *config)
+{
+    sampling_config next = *config;
+    const char * p = frame;
+    char key[10];
+    int value, n;
+    
+    if(strncmp(p, "C:", 2) != 0) {
+        return RET_NOK;
+    }
+    p += 2;
+    
+    while(1) {
+        n = 0;
+        if(sscanf(p, "%9[a-z]=%d%n", key, &value, &n) != 2 || n == 0) {
+            return RET_NOK;
+        }
+        
+        if(strcmp(key, "period") == 0 && value >= CONFIG_PERIOD_MIN && value <= CONFIG_PERIOD_MAX) {
+            next.period_ms = value;
+        } else if(strcmp(key, "window") == 0 && value >= CONFIG_WINDOW_MIN && value <= CONFIG_WINDOW_MAX) {
+            next.window = value;
+        } else if(strcmp(key, "level") == 0 && value >= 1 && value <= 99) {
+            next.level = value;
+        } else if(strcmp(key, "trust") == 0 && value >= 1 && value <= 100) {
+            next.trust = value;
+        } else if(strcmp(key, "heartbeat") == 0 && value >= CONFIG_HEARTBEAT_MIN && value <= CONFIG_HEARTBEAT_MAX) {
+            next.heartbeat = value;
+        } else {
+            return RET_NOK;
+        }
+        
+        p += n;
+        if(*p != ',') break;
+        p++;
+    }
+    
+    if(*p != '\0' && *p != '\r' && *p != '\n') {
+        return RET_NOK;
+    }
+    
+    *config = next;
+    return RET_OK;
+}
+
+// Scans every line of a server reply for C: frames. Only parses: the result is persisted
+// when it is applied at the window boundary, after the socket is closed.
+int8_t checkDownlink(const char * reply, sampling_config *config)
 {
     int8_t ret = RET_NOK;
-    int id = 0;
-    int recvCount = 0;
-    
-    _parser->set_timeout(BG96_RECV_TIMEOUT);   
-     
-    if( _parser->send("AT+QIRD=%d", id) && _parser->recv("+QIRD:%d\r\n",&recvCount) ) {
-        if(recvCount > 0) {
-            _parser->getc();
-            _parser->read(data, recvCount);
-            if(_parser->recv("OK")) {
+    const char * line = reply;
+    
+    while(line != NULL && *line != '\0') {
+        if(strncmp(line, "C:", 2) == 0) {
+            if(parseConfigFrame(line, config) == RET_OK) {
+                devlog("Config frame accepted\r\n");
                 ret = RET_OK;
             } else {
-                recvCount = 0;
+                devlog("Config frame rejected\r\n");
             }
-        }        
-    }
-    _parser->set_timeout(BG96_DEFAULT_TIMEOUT);    
-    _parser->flush();
-    
-    *len = recvCount;
+        }
         
+        line = strchr(line, '\n');
+        if(line != NULL) line++;
+    }
     return ret;
 }
 
+// ----------------------------------------------------------------
+// Functions: Report formatting (integer only, no printf float support)
+// ----------------------------------------------------------------
+
+char * appendStr(char * dst, const char * str)
+{
+    while(*str) *dst++ = *str++;
+    *dst = '\0';
+    return dst;
+}
+
+char * appendUint(char * dst, uint32_t value)
+{
+    char tmp[10];
+    int n = 0;
+    
+    do {
+        tmp[n++] = '0' + (value % 10);
+        value /= 10;
+    } while(value);
+    
+    while(n) *dst++ = tmp[--n];
+    *dst = '\0';
+    return dst;
+}
+
+char * appendFixed(char * dst, float value, int decimals) // same digits as "%.<decimals>f"
+{
+    uint32_t scale = 1;
+    uint32_t whole, frac;
+    
+    for(int i=0; i<decimals; i++) scale *= 10;
+    
+    if(value < 0) {
+        *dst++ = '-';
+        value = -value;
+    }
+    
+    // Split before scaling, so the fraction keeps the full float precision
+    whole = (uint32_t)value;
+    frac = (uint32_t)((value - whole) * scale + 0.5f);
+    if(frac >= scale) {
+        whole++;
+        frac -= scale;
+    }
+    
+    dst = appendUint(dst, whole);
+    if(decimals > 0) {
+        *dst++ = '.';
+        for(uint32_t d = scale / 10; d > 0; d /= 10) {
+            *dst++ = '0' + (frac / d) % 10;
+        }
+    }
+    *dst = '\0';
+    return dst;
+}
+
+const char * fixedStr(char * dst, float value, int decimals) // appendFixed for printf("%s")
+{
+    appendFixed(dst, value, decimals);
+    return dst;
+}
+
+// ----------------------------------------------------------------
+// Functions: Memory statistics
+// ----------------------------------------------------------------
+
+void printStackStats(void) // needs "platform.stack-stats-enabled"
+{
+#if MBED_STACK_STATS_ENABLED
+    static mbed_stats_stack_t stats[STACK_STATS_MAX_THREADS];  // static: stays out of the measured stack
+    int count = mbed_stats_stack_get_each(stats, STACK_STATS_MAX_THREADS);
+    
+    for(int i=0; i<count; i++) {
+        myprintf("Thread 0x%08lx stack: %lu/%lu bytes", (unsigned long)stats[i].thread_id,
+                 (unsigned long)stats[i].max_size, (unsigned long)stats[i].reserved_size);
+    }
+#endif
+}
+
 // ----------------------------------------------------------------
 // Functions: Cat.M1 GPS
 // ----------------------------------------------------------------
@@ -707,38 +894,4 @@ int8_t setGpsOnOff_BG96(bool onoff)
 }
  
  
-int8_t getGpsLocation_BG96(gps_data *data)
-{
-    int8_t ret = RET_NOK;    
-    char _buf[100];
-    
-    bool ok = false;    
-    Timer t;
-    
-    // Structure init: GPS info
-    data->utc = data->lat = data->lon = data->hdop= data->altitude = data->cog = data->spkm = data->spkn = data->nsat=0.0;
-    data->fix=0;
-    memset(&data->date, 0x00, 7);
-    
-    // timer start
-    t.start();
-    
-    while( !ok && (t.read_ms() < BG96_CONNECT_TIMEOUT ) ) {
-        _parser->flush();    
-        _parser->send((char*)"AT+QGPSLOC=2"); // MS-based mode        
-        ok = _parser->recv("+QGPSLOC: ");
-        if(ok) {
-            _parser->recv("%s\r\n", _buf);
-            sscanf(_buf,"%f,%f,%f,%f,%f,%d,%f,%f,%f,%6s,%d",
-                          &data->utc, &data->lat, &data->lon, &data->hdop,
-                          &data->altitude, &data->fix, &data->cog,
-                          &data->spkm, &data->spkn, data->date, &data->nsat);            
-            ok = _parser->recv("OK");
-        }         
-    }
-    
-    if(ok == true) ret = RET_OK;
-    
-    return ret;
-}
  